@@ -6,10 +6,21 @@
 #include "hardware/uart.h"
 #include "program.pio.h"
 #include "hardware/clocks.h"
+#include "board.h"
 
 // Set UART's baudrate
 #define BAUD_RATE 31250
 
+// The board type of the System Exclusive message that stores a new board ID
+#define BOARD_TYPE 0x46 // 'F'
+
+// Idle mode
+// After this much silence the state machines are stopped and the drives
+// released. The cores sleep until a start bit arrives on the RX pin.
+#ifndef IDLE_TIMEOUT_MS
+#define IDLE_TIMEOUT_MS 10000
+#endif
+
 // All floppy drive channels
 // (duplicates are not allowed)
 #define FDD1_CHANNEL 2
@@ -45,9 +56,13 @@ void init_uart() {
     uart_set_format(uart0, 8, 1, UART_PARITY_NONE);
 }
 
+// Where each state machine's program starts in the PIO memory
+uint program_offset[2][4];
+
 void fdd_program_init(PIO pio, uint sm, uint pin) {
     // Init one fdd program
     uint offset = pio_add_program(pio, &fdd_program);
+    program_offset[pio_get_index(pio)][sm] = offset;
     pio_gpio_init(pio, pin);
     pio_gpio_init(pio, pin + 1);
     pio_sm_set_consecutive_pindirs(pio, sm, pin, 2, true);
@@ -184,7 +199,57 @@ float pitch_to_note(uint16_t pitch) {
     return ((float) (((signed int) pitch - (signed int) 8192)) / 4096.0f);
 }
 
+bool is_playing() {
+    // Check if any FDD is turned on
+    return gpio_get_out_level(18) || gpio_get_out_level(19) ||
+        gpio_get_out_level(20) || gpio_get_out_level(21) ||
+        gpio_get_out_level(22) || gpio_get_out_level(26) ||
+        gpio_get_out_level(27) || gpio_get_out_level(28);
+}
+
+void stop_program(PIO pio, uint sm, uint pin) {
+    /* Stop one state machine and pull its STEP and DIR pins low. It is moved
+    back to "load", so the first value it pulls after waking up is the
+    next note. */
+    pio_sm_set_enabled(pio, sm, false);
+    pio_sm_set_pins_with_mask(pio, sm, 0, 0b11u << pin);
+    pio_sm_exec(pio, sm, pio_encode_jmp(program_offset[pio_get_index(pio)][sm]));
+}
+
+void disable_pio() {
+    // Stop all the fdd programs
+    stop_program(pio0, 0, 2);
+    stop_program(pio0, 1, 4);
+    stop_program(pio0, 2, 6);
+    stop_program(pio0, 3, 8);
+    stop_program(pio1, 0, 10);
+    stop_program(pio1, 1, 12);
+    stop_program(pio1, 2, 14);
+    stop_program(pio1, 3, 16);
+}
+
+bool enter_idle() {
+    // Stop the state machines, unless something is still playing
+    if (is_playing()) {
+        return false;
+    }
+    disable_pio();
+    return true;
+}
+
+void keep_awake() {
+    // Called after every message for this board, restarts the state machines
+    if (leave_idle()) {
+        enable_pio();
+    }
+}
+
 void run_command(uint channel, uint command, uint data1, uint data2) {
+    // Ignore messages that are meant for another board
+    if (selected_bank != board_id) {
+        return;
+    }
+
     switch (command) {
         case 0: // Note Off
             // Stop playing our note
@@ -242,13 +307,18 @@ void run_command(uint channel, uint command, uint data1, uint data2) {
             );
             break;
     }
+
+    // The state machines are started after the new value is in their FIFO
+    keep_awake();
 }
 
 int main() {
     // Call all startup functions
     stdio_usb_init(); // Only because the ability of updating software without entering BOOTSEL mode manually
+    init_board(BOARD_TYPE);
     reset();
     init_uart();
+    init_wakeup(IDLE_TIMEOUT_MS, enter_idle);
     init_pio();
     enable_pio();
     init_sio();
@@ -268,22 +338,27 @@ int main() {
 
     for (;;) {
         // Get the status byte
-        status = uart_getc(uart0);
+        status = receive_byte();
         status_MSB = (status >> 7u) & 1u;
         command = (status >> 4u) & 7u;
         channel = status & 15u;
 
+        // Port Select and System Exclusive messages are the same on all boards
+        if (receive_board_message(status)) {
+            continue;
+        }
+
         // Check if "status" is really an status byte and has MSB 1
         if (status_MSB == 1) {
             // Get data1 byte
-            data1 = uart_getc(uart0);
+            data1 = receive_byte();
             data1_MSB = (data1 >> 7u) & 1u;
             // Then check if data1 is a data byte and has MSB 0
             // Also check if data2 is required
             if (data1_MSB == 0) {
                 if (command != 4 && command != 5) {
                     // Get data2 byte
-                    data2 = uart_getc(uart0);
+                    data2 = receive_byte();
                     data2_MSB = (data2 >> 7u) & 1u;
                     // Data2 also has to be a data byte
                     if (data2_MSB == 0) {
@@ -5,11 +5,16 @@
 #include "hardware/uart.h"
 #include "program.pio.h"
 #include "hardware/clocks.h"
+#include "board.h"
 
 #define BAUD_RATE 31250
 #define HDD_CLICK_TIME 100000
 
-// All hdd note definitions
+// The board type of the System Exclusive message that stores a new board ID
+#define BOARD_TYPE 0x48 // 'H'
+
+// The percussion channel and all hdd note definitions
+#define HDD_CHANNEL 9
 #define HDD1_NOTE 35
 #define HDD2_NOTE 36
 #define HDD3_NOTE 37
@@ -93,13 +98,18 @@ void hdd_click(uint note) {
 }
 
 void run_command(uint channel, uint command, uint data1, uint data2) {
+    // Ignore messages that are meant for another board
+    if (selected_bank != board_id) {
+        return;
+    }
+
     switch (command) {
         case 0: // Note Off
             break;
 
         case 1: // Note On
             // Make a click sound on the specified hdd
-            if (channel == 9) {
+            if (channel == HDD_CHANNEL) {
                 if (data2 > 0) {
                     hdd_click(data1);
                 }
@@ -126,7 +136,9 @@ void run_command(uint channel, uint command, uint data1, uint data2) {
 int main() {
     // Call all startup functions
     stdio_usb_init(); // Only because the ability of updating software without entering BOOTSEL mode manually
+    init_board(BOARD_TYPE);
     init_uart();
+    init_wakeup(0, NULL); // The HDD state machines wait on a blocking pull, so there is no idle mode
     init_pio();
     init_sio();
     
@@ -144,22 +156,27 @@ int main() {
 
     for (;;) {
         // Get the status byte
-        status = uart_getc(uart0);
+        status = receive_byte();
         status_MSB = (status >> 7u) & 1u;
         command = (status >> 4u) & 7u;
         channel = status & 15u;
 
+        // Port Select and System Exclusive messages are the same on all boards
+        if (receive_board_message(status)) {
+            continue;
+        }
+
         // Check if "status" is really an status byte and has MSB 1
         if (status_MSB == 1) {
             // Get data1 byte
-            data1 = uart_getc(uart0);
+            data1 = receive_byte();
             data1_MSB = (data1 >> 7u) & 1u;
             // Then check if data1 is a data byte and has MSB 0
             // Also check if data2 is required
             if (data1_MSB == 0) {
                 if (command != 4 && command != 5) {
                     // Get data2 byte
-                    data2 = uart_getc(uart0);
+                    data2 = receive_byte();
                     data2_MSB = (data2 >> 7u) & 1u;
                     // Data2 also has to be a data byte
                     if (data2_MSB == 0) {
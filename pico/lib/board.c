@@ -0,0 +1,163 @@
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/flash.h"
+#include "hardware/gpio.h"
+#include "hardware/uart.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "board.h"
+
+// The board ID is stored in the last flash sector
+#define CONFIG_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+#define CONFIG_MAGIC 0x464C4F50 // "FLOP"
+
+// The stored board config
+struct Config {
+    uint32_t magic;
+    uint8_t board_id;
+};
+uint8_t board_id;
+uint8_t selected_bank = 0;
+static uint8_t board_type;
+
+// Set by the RX pin interrupt when a byte starts coming in
+static volatile bool rx_edge = false;
+// Called when nothing arrived for this board for a while, NULL without idle mode
+static bool (*idle_handler)() = NULL;
+static uint32_t idle_timeout_ms;
+static bool idle = false;
+static absolute_time_t idle_at;
+
+void init_board(uint8_t type) {
+    // Load the board ID from flash, or use the default one if nothing is stored
+    const struct Config *config = (const struct Config *) (XIP_BASE + CONFIG_OFFSET);
+    board_type = type;
+    if (config->magic == CONFIG_MAGIC && config->board_id < 128) {
+        board_id = config->board_id;
+    } else {
+        board_id = DEFAULT_BOARD_ID;
+    }
+}
+
+static void write_config(void *page) {
+    // Runs while interrupts (and core1 on the scanner) are paused
+    flash_range_erase(CONFIG_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(CONFIG_OFFSET, (const uint8_t *) page, FLASH_PAGE_SIZE);
+}
+
+static void save_board_id(uint8_t id) {
+    // Store a new board ID in flash and start using it
+    uint8_t page[FLASH_PAGE_SIZE];
+    struct Config config = {CONFIG_MAGIC, id};
+    memset(page, 0xFF, FLASH_PAGE_SIZE);
+    memcpy(page, &config, sizeof(config));
+    // Only switch to the new ID once it is stored, so it survives a power cycle
+    if (flash_safe_execute(write_config, page, 1000) == PICO_OK) {
+        board_id = id;
+    }
+}
+
+static void on_rx_edge(uint gpio, uint32_t events) {
+    // A falling edge on the RX pin, so a byte is being received
+    rx_edge = true;
+    __sev();
+}
+
+void init_wakeup(uint32_t timeout_ms, bool (*enter_idle)()) {
+    /* Wake up the sleeping core when a start bit arrives. After
+    "timeout_ms" without a message for this board, enter_idle() is
+    called. It returns false if the board has to stay awake. */
+    gpio_set_irq_enabled_with_callback(RX_PIN, GPIO_IRQ_EDGE_FALL, true, &on_rx_edge);
+    idle_handler = enter_idle;
+    idle_timeout_ms = timeout_ms;
+    idle_at = make_timeout_time_ms(idle_timeout_ms);
+}
+
+bool leave_idle() {
+    // Called after every message for this board, returns true if it was idle
+    bool was_idle = idle;
+    idle = false;
+    idle_at = make_timeout_time_ms(idle_timeout_ms);
+    return was_idle;
+}
+
+uint8_t receive_byte() {
+    /* Wait for the next UART byte. Instead of spinning in uart_getc(),
+    the core sleeps until the RX pin interrupt fires or the idle timeout
+    passes. A byte that has started takes at most one byte time to
+    arrive, that part is waited for the normal way. */
+    if (!uart_is_readable(uart0)) {
+        while (!uart_is_readable(uart0)) {
+            if (rx_edge) {
+                rx_edge = false;
+                uart_is_readable_within_us(uart0, 2 * BYTE_TIME_US);
+                continue;
+            }
+            if (idle_handler == NULL || idle) {
+                __wfe();
+            } else if (best_effort_wfe_or_timeout(idle_at)) {
+                idle = idle_handler();
+                idle_at = make_timeout_time_ms(idle_timeout_ms);
+            }
+        }
+        // The byte has just arrived, so the next one can't have started yet.
+        // Forget the edges of its data bits, otherwise the next call would
+        // wait for a byte that isn't coming instead of going to sleep. When
+        // a byte was already waiting, the next one may be on its way, so
+        // the flag is kept.
+        rx_edge = false;
+    }
+    return (uint8_t) uart_getc(uart0);
+}
+
+static void receive_sysex() {
+    /* Read a System Exclusive message up to its end byte. The only
+    one we use is F0 7D <board type> <board id> F7, which stores a
+    new board ID on all boards of that type. */
+    uint8_t data[3];
+    uint8_t length = 0;
+    uint8_t byte;
+
+    for (;;) {
+        byte = receive_byte();
+        if (byte == SYSEX_END) {
+            break;
+        }
+        if (byte >= 0xF8) {
+            continue; // Real-time messages may appear anywhere
+        }
+        if ((byte >> 7u) & 1u) {
+            return; // Broken message
+        }
+        if (length < 3) {
+            data[length] = byte;
+        }
+        length++;
+    }
+
+    if (length == 3 && data[0] == SYSEX_ID && data[1] == board_type) {
+        save_board_id(data[2]);
+    }
+}
+
+bool receive_board_message(uint8_t status) {
+    /* Handle the messages that are the same on all boards. Returns true
+    if "status" started one of them and the whole message was read. */
+    uint8_t bank;
+
+    // System Exclusive messages are only used for the board config
+    if (status == SYSEX_START) {
+        receive_sysex();
+        return true;
+    }
+
+    // Port Select messages choose the board of the following messages
+    if (status == PORT_SELECT) {
+        bank = receive_byte();
+        if (((bank >> 7u) & 1u) == 0) {
+            selected_bank = bank;
+        }
+        return true;
+    }
+    return false;
+}
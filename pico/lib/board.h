@@ -0,0 +1,32 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+#include "pico/stdlib.h"
+
+// Board addressing
+// Every board only listens to the bank (group of 16 midi channels) that
+// matches its board ID. player.py selects the bank with a Port Select
+// message, so identical images can share the same serial line.
+#ifndef DEFAULT_BOARD_ID
+#define DEFAULT_BOARD_ID 0
+#endif
+#define PORT_SELECT 0xF5
+#define SYSEX_START 0xF0
+#define SYSEX_END 0xF7
+#define SYSEX_ID 0x7D // Non-commercial manufacturer ID
+
+// The core sleeps until a start bit arrives on the RX pin
+#define RX_PIN 1
+#define BYTE_TIME_US (10 * 1000000 / 31250) // Start bit, 8 data bits and stop bit
+
+// The board ID and the bank we're currently listening to
+extern uint8_t board_id;
+extern uint8_t selected_bank;
+
+void init_board(uint8_t type);
+bool receive_board_message(uint8_t status);
+void init_wakeup(uint32_t idle_timeout_ms, bool (*enter_idle)());
+bool leave_idle();
+uint8_t receive_byte();
+
+#endif
@@ -1,6 +1,8 @@
 #include "endstops.h"
 #include "pico/multicore.h"
+#include "pico/flash.h"
 #include "hardware/gpio.h"
+#include "hardware/sync.h"
 
 void init_core1() {
     // Start the direction manager core
@@ -8,6 +10,9 @@ void init_core1() {
 }
 
 void endstops() {
+    // Let core0 pause this core while it writes the board config to flash
+    flash_safe_execute_core_init();
+
     // An array with the ignored switches (they need to be ignored if being held)
     bool ignored_switches[4] = {0, 0, 0, 0};
     
@@ -24,6 +29,14 @@ void endstops() {
     gpio_init(17); gpio_set_dir(17, false);
 
     for (;;) {
+        // Sleep while all DRV8825s are asleep, the heads can't move then.
+        // Core0 sends an event when it wakes one up.
+        if (!gpio_get_out_level(10) && !gpio_get_out_level(11) &&
+            !gpio_get_out_level(12) && !gpio_get_out_level(13)) {
+            __wfe();
+            continue;
+        }
+
         // Change direction in case of endstops activated
         if (gpio_get(14) && !ignored_switches[0]) {
             gpio_put(3, !gpio_get_out_level(3));
@@ -5,11 +5,23 @@
 #include "hardware/uart.h"
 #include "program.pio.h"
 #include "hardware/clocks.h"
+#include "hardware/sync.h"
+#include "board.h"
 #include "endstops.h"
 #include <math.h>
 
 #define BAUD_RATE 31250
 
+// The board type of the System Exclusive message that stores a new board ID
+#define BOARD_TYPE 0x53 // 'S'
+
+// Idle mode
+// After this much silence the state machines are stopped and the drives
+// released. The cores sleep until a start bit arrives on the RX pin.
+#ifndef IDLE_TIMEOUT_MS
+#define IDLE_TIMEOUT_MS 10000
+#endif
+
 // All scanner channels
 // (duplicates are not allowed)
 #define SCANNER1_CHANNEL 0
@@ -52,9 +64,13 @@ void init_sio() {
     gpio_put(25, 1);
 }
 
+// Where each state machine's program starts in the PIO memory
+uint program_offset[2][4];
+
 void scanner_program_init(PIO pio, uint sm, uint pin) {
     // Init the scanner program
     uint offset = pio_add_program(pio, &scanner_program);
+    program_offset[pio_get_index(pio)][sm] = offset;
     pio_gpio_init(pio, pin);
     pio_sm_set_consecutive_pindirs(pio, sm, pin, 1, true);
     pio_sm_config config = scanner_program_get_default_config(offset);
@@ -64,16 +80,21 @@ void scanner_program_init(PIO pio, uint sm, uint pin) {
     pio_sm_init(pio, sm, offset, &config);
 }
 
+void enable_pio() {
+    // Enable the scanner programs
+    pio_sm_set_enabled(pio0, 0, true);
+    pio_sm_set_enabled(pio0, 1, true);
+    pio_sm_set_enabled(pio0, 2, true);
+    pio_sm_set_enabled(pio0, 3, true);
+}
+
 void init_pio() {
     // Init the scanner programs
     scanner_program_init(pio0, 0, 2);
     scanner_program_init(pio0, 1, 4);
     scanner_program_init(pio0, 2, 6);
     scanner_program_init(pio0, 3, 8);
-    pio_sm_set_enabled(pio0, 0, true);
-    pio_sm_set_enabled(pio0, 1, true);
-    pio_sm_set_enabled(pio0, 2, true);
-    pio_sm_set_enabled(pio0, 3, true);
+    enable_pio();
 }
 
 void stop_playing(int channel) {
@@ -90,6 +111,8 @@ void start_playing(int channel) {
     if (channel == SCANNER2_CHANNEL) {gpio_put(11, true);}
     if (channel == SCANNER3_CHANNEL) {gpio_put(12, true);}
     if (channel == SCANNER4_CHANNEL) {gpio_put(13, true);}
+    // Wake up the endstop core
+    __sev();
 }
 
 void set_frequency(int channel, int freq) {
@@ -110,7 +133,51 @@ float pitch_to_note(uint16_t pitch) {
     return ((float) (((signed int) pitch - (signed int) 8192)) / 4096.0f);
 }
 
+void stop_program(PIO pio, uint sm, uint pin) {
+    /* Stop one state machine and pull its STEP pin low. It is moved
+    back to "load", so the first value it pulls after waking up is the
+    next note. */
+    pio_sm_set_enabled(pio, sm, false);
+    pio_sm_set_pins_with_mask(pio, sm, 0, 1u << pin);
+    pio_sm_exec(pio, sm, pio_encode_jmp(program_offset[pio_get_index(pio)][sm]));
+}
+
+void disable_pio() {
+    // Stop all the scanner programs
+    stop_program(pio0, 0, 2);
+    stop_program(pio0, 1, 4);
+    stop_program(pio0, 2, 6);
+    stop_program(pio0, 3, 8);
+}
+
+bool is_playing() {
+    // Check if any DRV8825 is awake
+    return gpio_get_out_level(10) || gpio_get_out_level(11) ||
+        gpio_get_out_level(12) || gpio_get_out_level(13);
+}
+
+bool enter_idle() {
+    // Stop the state machines, unless something is still playing
+    if (is_playing()) {
+        return false;
+    }
+    disable_pio();
+    return true;
+}
+
+void keep_awake() {
+    // Called after every message for this board, restarts the state machines
+    if (leave_idle()) {
+        enable_pio();
+    }
+}
+
 void run_command(uint channel, uint command, uint data1, uint data2) {
+    // Ignore messages that are meant for another board
+    if (selected_bank != board_id) {
+        return;
+    }
+
     switch (command) {
         case 0: // Note Off
             // Stop playing our note
@@ -168,12 +235,17 @@ void run_command(uint channel, uint command, uint data1, uint data2) {
             );
             break;
     }
+
+    // The state machines are started after the new value is in their FIFO
+    keep_awake();
 }
 
 int main() {
     // Call all startup functions
     stdio_usb_init(); // Only because the ability of updating software without entering BOOTSEL mode manually
+    init_board(BOARD_TYPE);
     init_uart();
+    init_wakeup(IDLE_TIMEOUT_MS, enter_idle);
     init_pio();
     init_sio();
     init_data();
@@ -193,22 +265,27 @@ int main() {
 
     for (;;) {
         // Get the status byte
-        status = uart_getc(uart0);
+        status = receive_byte();
         status_MSB = (status >> 7u) & 1u;
         command = (status >> 4u) & 7u;
         channel = status & 15u;
 
+        // Port Select and System Exclusive messages are the same on all boards
+        if (receive_board_message(status)) {
+            continue;
+        }
+
         // Check if "status" is really an status byte and has MSB 1
         if (status_MSB == 1) {
             // Get data1 byte
-            data1 = uart_getc(uart0);
+            data1 = receive_byte();
             data1_MSB = (data1 >> 7u) & 1u;
             // Then check if data1 is a data byte and has MSB 0
             // Also check if data2 is required
             if (data1_MSB == 0) {
                 if (command != 4 && command != 5) {
                     // Get data2 byte
-                    data2 = uart_getc(uart0);
+                    data2 = receive_byte();
                     data2_MSB = (data2 >> 7u) & 1u;
                     // Data2 also has to be a data byte
                     if (data2_MSB == 0) {
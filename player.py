@@ -14,9 +14,14 @@
 
 print('Loading modules... ', end='', flush = True)
 import mido
+import os
+import re
 import sys
 import serial
-from time import sleep
+import argparse
+import threading
+from concurrent.futures import ThreadPoolExecutor
+from time import sleep, perf_counter
 from termcolor import cprint
 cprint('DONE', color = 'green', flush = True)
 
@@ -31,46 +36,352 @@ cprint('''
                 |_|   |_|               
       ''', color = 'blue', flush = True)
 
+# Status byte of the Port Select message. Every pico only listens to the bank
+# (a group of 16 midi channels) that matches its board ID, so channel 16 * bank
+# + channel of the "extended" channel namespace ends up on board number "bank".
+PORT_SELECT = 0xF5
+
+# Manufacturer ID and board types of the System Exclusive message that stores a
+# new board ID in the pico's flash: F0 7D <board type> <board id> F7
+SYSEX_ID = 0x7D
+BOARD_TYPES = {'floppy': 0x46, 'scanner': 0x53, 'hdd': 0x48}
+
+# The firmware sources, which define the channels and notes the picos listen to
+PICO_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'pico')
+
+# Time one byte takes on the wire: start bit, 8 data bits and stop bit
+BYTE_TIME = 10 / 31250
+# Live input is held back while more than this many bytes are ahead of it on
+# the wire. The kernel's out_waiting count misses the UART's hardware FIFO
+# (16 bytes on the pi), so the time the wire is busy is tracked here.
+WIRE_SLACK = 3
+
 port = None
+current_bank = 0
+used_banks = {0}
+# The last note and the pitchwheel value of every (bank, channel) pair, so
+# only the notes that are still playing are stopped between two songs
+sounding = {}
+bends = {}
 
-# Opening the midi file with mido
-print('Loading midi file... ', end = '', flush = True)
+parser = argparse.ArgumentParser(description = 'FDD, HDD and scanner music using MIDI Files')
+parser.add_argument('files', nargs = '*', metavar = 'file', help = 'the midi files to play, one after another')
+parser.add_argument('--playlist', metavar = 'FILE', help = 'a text file with one midi file per line to play after the others')
+parser.add_argument('--set-board-id', nargs = 2, metavar = ('TYPE', 'ID'),
+                    help = 'store a new board ID on the connected picos of TYPE (floppy, scanner or hdd)')
+parser.add_argument('--live', nargs = '?', const = '', metavar = 'PORT',
+                    help = 'play from a midi input PORT, or from a new virtual port if no PORT is given')
+parser.add_argument('--bank', type = int, default = 0, choices = range(128), metavar = 'BANK',
+                    help = 'the board bank live input is sent to (default: 0)')
+args = parser.parse_args()
 
-try:
-    MidiFile = mido.MidiFile(sys.argv[1])
-except IndexError:
-    cprint('\n[FATAL] ', color = 'red', end = '', flush = True)
-    print('Please specify the midi file.', flush = True)
-    exit()
-except OSError:
-    cprint('\n[FATAL] ', color = 'red', end = '', flush = True)
-    print('File not found.', flush = True)
-    exit()
+if args.set_board_id == None and args.live == None:
+    # Opening the midi file with mido
+    print('Loading midi file... ', end = '', flush = True)
+
+    songs = list(args.files)
+    try:
+        if args.playlist != None:
+            # Entries are relative to the playlist file, like in m3u playlists
+            folder = os.path.dirname(args.playlist)
+            with open(args.playlist) as playlist:
+                songs += [os.path.join(folder, line.strip()) for line in playlist
+                          if line.strip() != '' and not line.startswith('#')]
+        if len(songs) == 0:
+            cprint('\n[FATAL] ', color = 'red', end = '', flush = True)
+            print('Please specify the midi file.', flush = True)
+            exit()
+        MidiFile = mido.MidiFile(songs[0])
+    except OSError:
+        cprint('\n[FATAL] ', color = 'red', end = '', flush = True)
+        print('File not found.', flush = True)
+        exit()
+
+    cprint('DONE\n', color = 'green', flush = True)
 
-cprint('DONE\n', color = 'green', flush = True)
+def select_bank(port, bank):
+    # Tell the picos which board the following messages are meant for.
+    # Nothing is sent as long as only bank 0 is used, so older firmwares
+    # keep working with single-board setups.
+    global current_bank
+    if bank != current_bank:
+        port.write(bytes([PORT_SELECT, bank]))
+        current_bank = bank
+        used_banks.add(bank)
+
+def reset_bank(port):
+    # The picos keep the selected bank, even when an earlier run was killed
+    # before cleanup(). F5 00 00 selects bank 0 on the picos with board IDs,
+    # which skip the extra 00, and older firmwares ignore it as an unknown
+    # 3-byte message. So it is safe to send with single-board setups.
+    global current_bank
+    port.write(bytes([PORT_SELECT, 0, 0]))
+    current_bank = 0
 
 def cleanup(port):
-    # Send All Notes Off message to all channels
+    # Send All Notes Off message to all channels of all used boards
     if port != None:
-        for i in range(16):
-            port.write(bytes([0b10110000 + i]))
-            port.write(bytes([120]))
-            port.write(bytes([0]))
-            sleep(0.01)
+        for bank in sorted(used_banks):
+            select_bank(port, bank)
+            for i in range(16):
+                port.write(bytes([0b10110000 + i]))
+                port.write(bytes([120]))
+                port.write(bytes([0]))
+                sleep(0.01)
+        select_bank(port, 0)
+
+def track_notes(bank, data):
+    # Remember what is playing, the same way the firmwares do (one note per channel)
+    key = (bank, data[0] & 0x0F)
+    command = data[0] & 0xF0
+    if command == 0x90 and data[2] > 0: # Note On
+        sounding[key] = data[1]
+    elif command == 0x80 or command == 0x90: # Note Off
+        if sounding.get(key) == data[1]:
+            del sounding[key]
+    elif command == 0xB0 and data[1] in (120, 123): # All Notes Off, All Sound Off
+        sounding.pop(key, None)
+    elif command == 0xE0: # Pitch Bend
+        bends[key] = (data[2] << 7) | data[1]
+
+def release_notes(port):
+    # Stop only the notes that are still playing and center bent pitchwheels,
+    # which is all the next song needs
+    for (bank, channel), note in sorted(sounding.items()):
+        select_bank(port, bank)
+        port.write(bytes([0x80 + channel, note, 0]))
+    for (bank, channel), bend in sorted(bends.items()):
+        if bend != 8192:
+            select_bank(port, bank)
+            port.write(bytes([0xE0 + channel, 0, 64]))
+    sounding.clear()
+    bends.clear()
+
+def send_msg(port, data, bank = 0):
+    # Send a message to all picos, system messages don't belong to a bank
+    if data[0] < 0xF0:
+        select_bank(port, bank)
+        track_notes(bank, data)
+    port.write(data)
+
+def extended_messages(midi_file):
+    # Merge all tracks like mido does, but keep the MIDI Port meta messages
+    # of every track so each message is sent to the right bank.
+    events = []
+    for track in midi_file.tracks:
+        tick = 0
+        bank = 0
+        for msg in track:
+            tick += msg.time
+            if msg.type == 'midi_port':
+                bank = msg.port & 0x7F
+            elif msg.type == 'set_tempo' or not msg.is_meta:
+                events.append((tick, bank, msg))
+    events.sort(key = lambda event: event[0]) # Stable, so track order is kept
+
+    # Translate the absolute ticks to seconds since the start of the file
+    tempo = mido.midifiles.midifiles.DEFAULT_TEMPO
+    last_tick = 0
+    seconds = 0.0
+    for tick, bank, msg in events:
+        seconds += mido.tick2second(tick - last_tick, midi_file.ticks_per_beat, tempo)
+        last_tick = tick
+        if msg.type == 'set_tempo':
+            tempo = msg.tempo
+        else:
+            yield seconds, bank, msg
+
+def compile_song(midi_file):
+    # Turn a midi file into a list of (seconds, bank, bytes) that is ready to send
+    return [(seconds, bank, bytes(msg.bytes())) for seconds, bank, msg in extended_messages(midi_file)]
+
+def load_song(path):
+    # Runs on the background thread while the previous song plays
+    return compile_song(mido.MidiFile(path))
+
+def play(port, song):
+    # Play all messages of the song at the right time
+    start_time = perf_counter()
+    for seconds, bank, data in song:
+        duration_to_next_event = seconds - (perf_counter() - start_time)
+        if duration_to_next_event > 0.0:
+            sleep(duration_to_next_event)
+        send_msg(port, data, bank)
+
+def play_all(port, songs):
+    # Play the songs back to back. The next one is loaded on a background
+    # thread, so only the notes that are still on are stopped in between.
+    # A short switch interval keeps the parsing thread from delaying notes.
+    sys.setswitchinterval(0.0005)
+    loader = ThreadPoolExecutor(max_workers = 1)
+    next_song = loader.submit(compile_song, MidiFile)
+    try:
+        for i, path in enumerate(songs):
+            # Stop the previous song's notes first, the next one may still be loading
+            if i > 0:
+                release_notes(port)
+            try:
+                song = next_song.result()
+            except Exception as error: # Missing or broken files don't stop the show
+                cprint('[ERROR] ', color = 'red', end = '', flush = True)
+                print('Could not load ' + path + ' (' + (str(error) or type(error).__name__) + '), skipping.', flush = True)
+                song = []
+            if i + 1 < len(songs):
+                next_song = loader.submit(load_song, songs[i + 1])
+            if song:
+                print('Playing ' + path, flush = True)
+                play(port, song) # Sends the messages to all picos
+    finally:
+        loader.shutdown(wait = False, cancel_futures = True)
+
+def read_defines(path):
+    # Read the "#define NAME number" lines of a firmware
+    with open(path) as file:
+        return {name: int(value) for name, value in re.findall(r'#define\s+(\w+)\s+(\d+)\b', file.read())}
+
+def firmware_channels():
+    # The channels and notes the firmwares listen to, straight from their defines
+    floppy = read_defines(os.path.join(PICO_DIR, 'floppy', 'floppy.c'))
+    scanner = read_defines(os.path.join(PICO_DIR, 'scanner', 'scanner.c'))
+    hdd = read_defines(os.path.join(PICO_DIR, 'hdd', 'hdd.c'))
+    channels = {floppy[name] for name in floppy if re.match(r'FDD\d+_CHANNEL$', name)}
+    channels |= {scanner[name] for name in scanner if re.match(r'SCANNER\d+_CHANNEL$', name)}
+    hdd_notes = {hdd[name] for name in hdd if re.match(r'HDD\d+_NOTE$', name)}
+    return channels, hdd['HDD_CHANNEL'], hdd_notes
+
+def is_playable(msg, channels, hdd_channel, hdd_notes):
+    # Apply the same channel filtering the firmwares use, so nothing
+    # is sent that would only delay the next note on the wire
+    if msg.type not in ('note_on', 'note_off', 'control_change', 'pitchwheel'):
+        return False
+    if msg.channel == hdd_channel:
+        return msg.type == 'note_on' and msg.note in hdd_notes
+    if msg.channel in channels:
+        return msg.type != 'control_change' or msg.control in (120, 123)
+    return False
+
+def coalesce(pending):
+    # Drop pitchwheel messages that are replaced by a newer one before
+    # anything else happened on their channel. The newest value is sent
+    # with the arrival time of the oldest one, which it stands in for.
+    msgs = []
+    last_pitchwheel = {}
+    for arrival, msg in pending:
+        if msg.type == 'pitchwheel' and msg.channel in last_pitchwheel:
+            index = last_pitchwheel[msg.channel]
+            arrival = msgs[index][0]
+            msgs[index] = None
+        if msg.type == 'pitchwheel':
+            last_pitchwheel[msg.channel] = len(msgs)
+        else:
+            last_pitchwheel.pop(msg.channel, None)
+        msgs.append((arrival, msg))
+    return [item for item in msgs if item is not None]
+
+def live(port, port_name, bank):
+    # Forward live midi input to the picos as soon as the wire is free
+    try:
+        channels, hdd_channel, hdd_notes = firmware_channels()
+    except (OSError, KeyError):
+        cprint('[FATAL] ', color = 'red', end = '', flush = True)
+        print('Live mode needs the firmware sources in ' + PICO_DIR + '.', flush = True)
+        exit()
+
+    # Messages are timestamped as soon as they arrive, on the midi input thread
+    received = []
+    arrived = threading.Condition()
+    def on_message(msg):
+        if is_playable(msg, channels, hdd_channel, hdd_notes):
+            with arrived:
+                received.append((perf_counter(), msg))
+                arrived.notify()
+
+    if port_name == '':
+        inport = mido.open_input('FloppIO', virtual = True, callback = on_message)
+    else:
+        inport = mido.open_input(port_name, callback = on_message)
+    print('Listening on ' + inport.name + '. Press Ctrl-C to stop.', flush = True)
+    select_bank(port, bank)
+    port.flush() # Everything that was written so far is out from here on
+    wire_free = perf_counter()
 
-def send_msg(port, msg):
-    # Send a message to all picos
-    port.write(bytes(msg.bytes()))
+    count = 0
+    dropped = 0
+    total = 0.0
+    worst = 0.0
+    last_report = perf_counter()
+    try:
+        while True:
+            with arrived:
+                while len(received) == 0:
+                    arrived.wait()
+
+            # Hold the messages back while the wire is busy, so newer
+            # pitchwheels replace older ones here instead of queueing up
+            # in the serial driver and the UART
+            busy = wire_free - perf_counter() - WIRE_SLACK * BYTE_TIME
+            if busy > 0.0:
+                sleep(busy)
+
+            with arrived:
+                pending = received[:]
+                received.clear()
+            msgs = coalesce(pending)
+            dropped += len(pending) - len(msgs)
+
+            # Input-to-wire latency: from the arrival of a message until its
+            # first byte goes out, after everything that is queued before it
+            data = bytearray()
+            now = perf_counter()
+            start = max(now, wire_free)
+            for arrival, msg in msgs:
+                latency = start + len(data) * BYTE_TIME - arrival
+                count += 1
+                total += latency
+                worst = max(worst, latency)
+                data += bytes(msg.bytes())
+            port.write(data)
+            wire_free = start + len(data) * BYTE_TIME
+
+            if now - last_report > 1.0:
+                print('\rLatency: %.3f ms average, %.3f ms max, %d pitchwheels merged '
+                      % (total / count * 1000, worst * 1000, dropped), end = '', flush = True)
+                last_report = now
+    finally:
+        inport.close()
+        if count > 0:
+            print('\nForwarded ' + str(count) + ' messages, %.3f ms average and %.3f ms max latency'
+                  % (total / count * 1000, worst * 1000), flush = True)
+
+def set_board_id(port, board_type, board_id):
+    # Store a new board ID on all connected picos of the given type,
+    # so connect only the board you want to configure.
+    port.write(bytes([0xF0, SYSEX_ID, BOARD_TYPES[board_type], board_id, 0xF7]))
+    sleep(0.1)
 
 def main():
     global port
     # Open the serial port to the three picos
     port = serial.Serial('/dev/serial0', 31250, bytesize=8, parity='N', stopbits=1)
+    reset_bank(port)
+
+    if args.set_board_id != None:
+        board_type, board_id = args.set_board_id
+        if board_type not in BOARD_TYPES or not board_id.isdigit() or int(board_id) > 127:
+            cprint('[FATAL] ', color = 'red', end = '', flush = True)
+            print('Usage: --set-board-id floppy|scanner|hdd 0-127', flush = True)
+            exit()
+        set_board_id(port, board_type, int(board_id))
+        print('Board ID ' + board_id + ' stored. Goodbye', flush = True)
+        exit()
+
+    if args.live != None:
+        live(port, args.live, args.bank)
+        exit()
 
-    for msg in MidiFile.play():
-        send_msg(port, msg) # Sends the message to all picos
+    play_all(port, songs)
 
-    print('\nDone playing file. Goodbye', flush = True)
+    print('\nDone playing. Goodbye', flush = True)
     cleanup(port)
     exit()
 
@@ -10,5 +10,9 @@ cp example-midi/*.mid floppio/midi/
 cp pico/floppy/floppy.elf floppio/
 cp pico/scanner/scanner.elf floppio/
 cp pico/hdd/hdd.elf floppio/
+mkdir -p floppio/pico/floppy floppio/pico/scanner floppio/pico/hdd
+cp pico/floppy/floppy.c floppio/pico/floppy/
+cp pico/scanner/scanner.c floppio/pico/scanner/
+cp pico/hdd/hdd.c floppio/pico/hdd/
 sudo nano /boot/firmware/config.txt
 sudo reboot
@@ -0,0 +1,942 @@
+#  ______ _                  _____ ____
+# |  ____| |                |_   _/ __ \
+# | |__  | | ___  _ __  _ __  | || |  | |
+# |  __| | |/ _ \| '_ \| '_ \ | || |  | |
+# | |    | | (_) | |_) | |_) || || |__| |
+# |_|    |_|\___/| .__/| .__/_____\____/
+#                | |   | |
+#                |_|   |_|
+#
+# PIO simulator: runs the program.pio files of the three picos on a midi file
+# and writes pin traces (VCD), a rough audio render (WAV) and a timing report.
+#
+# Every state machine executes the real PIO instructions cycle by cycle at the
+# configured clock (1 MHz, like the firmwares). Loops that only wait (a "jmp x--"
+# over "set pins" and "nop") and repeating note periods are skipped in one step,
+# so whole songs simulate much faster than real time.
+
+import re
+import os
+import sys
+import math
+import wave
+import array
+import bisect
+import argparse
+from collections import deque
+
+import mido
+
+PICO_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'pico')
+
+BAUD_RATE = 31250
+BYTE_TIME = 10 * 1000000 / BAUD_RATE # One start bit, 8 data bits and one stop bit in us
+UART_FIFO_DEPTH = 32
+TX_FIFO_DEPTH = 4
+PORT_SELECT = 0xF5
+SYSEX_START = 0xF0
+SYSEX_END = 0xF7
+MASK = 0xFFFFFFFF
+
+# Operands the simulator knows. Input pins, the jmp pin, the status source,
+# the output shift counter and side-set are not modelled, so programs that
+# use them are refused instead of running with made-up values.
+JMP_CONDITIONS = ('', '!x', 'x--', '!y', 'y--', 'x!=y')
+MOV_SOURCES = ('x', 'y', 'null', 'isr', 'osr')
+MOV_DESTINATIONS = ('x', 'y', 'isr', 'osr')
+SET_DESTINATIONS = ('pins', 'x', 'y')
+PULL_OPTIONS = ('block', 'noblock')
+
+
+class PioError(Exception):
+    pass
+
+
+class Instruction:
+    def __init__(self, op, args, delay, line):
+        self.op = op
+        self.args = args
+        self.delay = delay
+        self.line = line
+        self.cycles = 1 + delay
+
+
+def parse_pio(path):
+    # Assemble a .pio file into a list of instructions per program
+    programs = {}
+    program = None
+
+    with open(path) as file:
+        source = file.read().splitlines()
+
+    for number, text in enumerate(source, 1):
+        text = re.split(r';|//', text)[0].strip()
+        if text == '':
+            continue
+        where = path + ':' + str(number)
+
+        if text.startswith('.program'):
+            program = text.split()[1]
+            programs[program] = {'instructions': [], 'labels': {}, 'wrap_target': 0, 'wrap': None}
+            continue
+        if program == None:
+            raise PioError(where + ': instruction outside of a program')
+        current = programs[program]
+
+        if text == '.wrap_target':
+            current['wrap_target'] = len(current['instructions'])
+            continue
+        if text == '.wrap':
+            current['wrap'] = len(current['instructions']) - 1
+            continue
+        if text.startswith('.'):
+            raise PioError(where + ': unsupported directive ' + text.split()[0])
+
+        label = re.match(r'^(?:public\s+)?(\w+):$', text)
+        if label:
+            current['labels'][label.group(1)] = len(current['instructions'])
+            continue
+
+        delay = 0
+        match = re.match(r'^(.*?)\s*\[\s*(\w+)\s*\]$', text)
+        if match:
+            text, delay = match.group(1), int(match.group(2), 0)
+        words = text.replace(',', ' ').split()
+        op, args = words[0].lower(), [word.lower() for word in words[1:]]
+        if op == 'nop':
+            op, args = 'mov', ['y', 'y']
+        if op not in ('jmp', 'pull', 'mov', 'set'):
+            raise PioError(where + ': unsupported instruction ' + op)
+        current['instructions'].append(Instruction(op, args, delay, where))
+
+    # Resolve the jump targets and check the operands
+    for program in programs.values():
+        if program['wrap'] == None:
+            program['wrap'] = len(program['instructions']) - 1
+        for ins in program['instructions']:
+            if ins.op == 'jmp':
+                if len(ins.args) not in (1, 2):
+                    raise PioError(ins.line + ': unsupported jmp operands ' + ' '.join(ins.args))
+                condition, target = ('', ins.args[0]) if len(ins.args) == 1 else ins.args
+                if condition not in JMP_CONDITIONS:
+                    raise PioError(ins.line + ': unsupported jmp condition ' + condition)
+                if target not in program['labels']:
+                    raise PioError(ins.line + ': unknown label ' + target)
+                ins.args = (condition, program['labels'][target])
+            elif ins.op == 'pull':
+                if len(ins.args) > 1 or any(option not in PULL_OPTIONS for option in ins.args):
+                    raise PioError(ins.line + ': unsupported pull options ' + ' '.join(ins.args))
+                ins.args = ('noblock' not in ins.args,)
+            elif ins.op == 'mov':
+                if len(ins.args) != 2:
+                    raise PioError(ins.line + ': unsupported mov operands ' + ' '.join(ins.args))
+                destination, source = ins.args
+                if destination not in MOV_DESTINATIONS:
+                    raise PioError(ins.line + ': unsupported mov destination ' + destination)
+                if source.lstrip('!~:') not in MOV_SOURCES:
+                    raise PioError(ins.line + ': unsupported mov source ' + source)
+                ins.args = (destination, source.lstrip('!~:'), source[:1] in '!~', source.startswith('::'))
+            elif ins.op == 'set':
+                if len(ins.args) != 2 or ins.args[0] not in SET_DESTINATIONS:
+                    raise PioError(ins.line + ': unsupported set operands ' + ' '.join(ins.args))
+                ins.args = (ins.args[0], int(ins.args[1], 0))
+    return programs
+
+
+class Segment:
+    # Edges of one period that repeat "count" more times after "start"
+    def __init__(self, start, period, count, edges):
+        self.start = start
+        self.period = period
+        self.count = count
+        self.edges = edges
+        self.end = start + (count + 1) * period
+
+
+class Trace:
+    # Pin value changes of one state machine, with repeating parts folded
+    def __init__(self, value = 0):
+        self.items = [(0, value)]
+        self.times = [0]
+
+    def add(self, time, value):
+        self.items.append((time, value))
+        self.times.append(time)
+
+    def repeat(self, segment):
+        self.items.append(segment)
+        self.times.append(segment.start + segment.period)
+
+    def value_at(self, time):
+        # The pin value at a given time
+        index = max(0, bisect.bisect_right(self.times, time) - 1)
+        item = self.items[index]
+        if not isinstance(item, Segment):
+            return item[1]
+        if not item.edges:
+            return self.value_at(item.start)
+        offset = (time - item.start) % item.period if time < item.end else item.period
+        value = item.edges[-1][1]
+        for edge_offset, edge_value in item.edges:
+            if edge_offset <= offset:
+                value = edge_value
+        return value
+
+    def edges(self, start = 0, end = math.inf, max_repeats = None):
+        # Yield all (time, value) changes between start and end. With
+        # max_repeats, only the first few passes of a repeating part are
+        # yielded, which is enough to check their timing.
+        index = max(0, bisect.bisect_right(self.times, start) - 1)
+        for item in self.items[index:]:
+            if isinstance(item, Segment):
+                first = max(1, int((start - item.start) // item.period))
+                last = item.count if max_repeats == None else min(item.count, first + max_repeats - 1)
+                for k in range(first, last + 1):
+                    base = item.start + k * item.period
+                    if base >= end:
+                        return
+                    for offset, value in item.edges:
+                        if start <= base + offset < end:
+                            yield base + offset, value
+            else:
+                if item[0] >= end:
+                    return
+                if item[0] >= start:
+                    yield item
+
+
+class StateMachine:
+    def __init__(self, name, program, pins):
+        self.name = name
+        self.program = program
+        self.instructions = program['instructions']
+        self.pins = pins # Names of the "set" pins, from the base pin up
+        self.pc = 0
+        self.x = 0
+        self.y = 0
+        self.osr = 0
+        self.isr = 0
+        self.value = 0
+        self.time = 0
+        self.fifo = deque()
+        self.trace = Trace()
+        self.latencies = [] # (write time, pull time)
+        self.loads = [] # (pull time, value) of every FIFO read
+        self.last_load = None
+
+    def put(self, value, time):
+        # Write to the TX FIFO, returns False if it is full
+        if len(self.fifo) >= TX_FIFO_DEPTH:
+            return False
+        self.fifo.append((value & MASK, time))
+        return True
+
+    def advance(self, pc):
+        # Go to the next instruction, wrapping like the hardware does
+        if pc == self.program['wrap'] + 1:
+            pc = self.program['wrap_target']
+        self.pc = pc
+
+    def set_value(self, value):
+        if value != self.value:
+            self.value = value
+            self.trace.add(self.time, value)
+
+    def read(self, source, invert, reverse):
+        if source == 'x':
+            value = self.x
+        elif source == 'y':
+            value = self.y
+        elif source == 'osr':
+            value = self.osr
+        elif source == 'isr':
+            value = self.isr
+        else: # null
+            value = 0
+        if invert:
+            value = ~value & MASK
+        if reverse:
+            value = int('{:032b}'.format(value)[::-1], 2)
+        return value
+
+    def pause(self, start, end):
+        # Disabled from "start" until "end" with the pins pulled low, and
+        # moved back to the start of the program like stop_program() does
+        self.time = start
+        self.set_value(0)
+        self.time = end
+        self.pc = self.program['wrap_target']
+        self.last_load = None
+
+    def run_until(self, end):
+        # Execute instructions that start before "end"
+        while self.time < end:
+            ins = self.instructions[self.pc]
+
+            if ins.op == 'jmp':
+                condition, target = ins.args
+                if condition == 'x--' and target < self.pc and self.x != 0:
+                    self.skip_loop(target)
+                taken = {
+                    '': True, '!x': self.x == 0, 'x--': self.x != 0, '!y': self.y == 0,
+                    'y--': self.y != 0, 'x!=y': self.x != self.y,
+                }[condition]
+                if condition == 'x--':
+                    self.x = (self.x - 1) & MASK
+                if condition == 'y--':
+                    self.y = (self.y - 1) & MASK
+                self.time += ins.cycles
+                if taken:
+                    self.pc = target
+                else:
+                    self.advance(self.pc + 1)
+
+            elif ins.op == 'pull':
+                block, = ins.args
+                if self.fifo:
+                    self.osr, written = self.fifo.popleft()
+                    self.latencies.append((written, self.time))
+                    self.loads.append((self.time, self.osr))
+                    self.last_load = None
+                elif block:
+                    self.time = end # Stall until the CPU writes something
+                    return
+                else:
+                    self.osr = self.x
+                    self.skip_periods(end)
+                self.time += ins.cycles
+                self.advance(self.pc + 1)
+
+            elif ins.op == 'mov':
+                destination, source, invert, reverse = ins.args
+                value = self.read(source, invert, reverse)
+                if destination == 'x':
+                    self.x = value
+                elif destination == 'y':
+                    self.y = value
+                elif destination == 'osr':
+                    self.osr = value
+                elif destination == 'isr':
+                    self.isr = value
+                self.time += ins.cycles
+                self.advance(self.pc + 1)
+
+            elif ins.op == 'set':
+                destination, value = ins.args
+                if destination == 'pins':
+                    self.set_value(value & ((1 << len(self.pins)) - 1))
+                elif destination == 'x':
+                    self.x = value
+                elif destination == 'y':
+                    self.y = value
+                self.time += ins.cycles
+                self.advance(self.pc + 1)
+
+    def skip_loop(self, target):
+        # A "jmp x--" back over instructions that only set the pins to their
+        # current value takes the same time on every pass, so do all at once
+        cycles = self.instructions[self.pc].cycles
+        for ins in self.instructions[target:self.pc]:
+            if ins.op == 'set' and ins.args == ('pins', self.value):
+                cycles += ins.cycles
+            elif ins.op == 'mov' and ins.args == ('y', 'y', False, False):
+                cycles += ins.cycles
+            else:
+                return
+        self.time += self.x * cycles
+        self.x = 0
+
+    def skip_periods(self, end):
+        # A noblock pull from an empty FIFO in the same state as the last one
+        # means the program repeats itself until the CPU writes the next value
+        state = (self.pc, self.x, self.y, self.osr, self.isr, self.value)
+        load = self.last_load
+        self.last_load = (state, self.time, len(self.trace.items))
+        if load == None or load[0] != state:
+            return
+        period = self.time - load[1]
+        items = self.trace.items[load[2]:]
+        if period <= 0 or any(isinstance(item, Segment) for item in items):
+            return
+        edges = [(time - load[1], value) for time, value in items]
+        # Stop before "end", the CPU may write to the FIFO right then
+        count = int(math.ceil((end - self.time) / period)) - 1
+        if count <= 0:
+            return
+        self.trace.repeat(Segment(load[1], period, count, edges))
+        self.time += count * period
+        self.last_load = (state, self.time, len(self.trace.items))
+
+
+def read_defines(path):
+    # Read the "#define NAME number" lines of a firmware
+    with open(path) as file:
+        return {name: int(value) for name, value in re.findall(r'#define\s+(\w+)\s+(\d+)\b', file.read())}
+
+
+def note_to_hz(note):
+    # Same rounding as the firmwares
+    return int(440.0 * math.pow(2.0, (note - 69.0) / 12.0))
+
+
+def pitch_to_note(pitch):
+    return (pitch - 8192) / 4096.0
+
+
+class Board:
+    # Base class of the firmware models: the byte parser of main() and the
+    # board addressing, the drives are handled by run_command()
+    def __init__(self, name, board_id):
+        self.name = name
+        self.board_id = board_id
+        self.selected_bank = 0
+        self.machines = []
+        self.outputs = {} # Extra gpio outputs: name -> Trace
+        self.stalls = []
+        self.warnings = {}
+        self.idle_timeout = None # In us, None if the firmware has no idle mode
+        self.last_message = 0
+
+    def warn(self, text):
+        self.warnings[text] = self.warnings.get(text, 0) + 1
+
+    def keep_awake(self, time):
+        # Idle mode: after the timeout without messages and with all drives
+        # off, the state machines are stopped with their pins pulled low.
+        # The next message for this board starts them again.
+        if self.idle_timeout != None:
+            idle_at = self.last_message + self.idle_timeout
+            playing = any(trace.items[-1][1] for trace in self.outputs.values())
+            if idle_at <= time and not playing:
+                for sm in self.machines:
+                    sm.run_until(idle_at)
+                    sm.pause(idle_at, time)
+        self.last_message = time
+
+    def run_until(self, time):
+        for sm in self.machines:
+            if sm != None:
+                sm.run_until(time)
+
+    def put_blocking(self, sm, value, time):
+        # pio_sm_put_blocking(): the whole main loop waits for FIFO space
+        if sm == None:
+            self.warn('write to a state machine that does not exist')
+            return time
+        start = time
+        while not sm.put(value, time):
+            pulls = len(sm.latencies)
+            sm.run_until(time + 1)
+            if len(sm.latencies) > pulls:
+                time = max(time, sm.latencies[pulls][1] + 1) # Right after the pull
+            else:
+                time = max(time + 1, sm.time)
+            self.run_until(time)
+        if time > start:
+            self.stalls.append((start, time - start))
+        return time
+
+    def gpio_put(self, name, value, time):
+        trace = self.outputs[name]
+        if trace.items[-1][1] != value:
+            trace.add(time, value)
+
+    def run_command(self, channel, command, data1, data2, time):
+        return time
+
+
+class FloppyBoard(Board):
+    # Keep in sync with init_pio() and init_sio() of pico/floppy/floppy.c
+    PINS = [2, 4, 6, 8, 10, 12, 14, 16]
+    ENABLE_PINS = [18, 19, 20, 21, 22, 26, 27, 28]
+    PREFIX = 'FDD'
+    DRIVES = 8
+
+    def __init__(self, name, board_id, program, defines):
+        Board.__init__(self, name, board_id)
+        self.channels = {}
+        for i in range(self.DRIVES):
+            drive = self.PREFIX.lower() + str(i + 1)
+            self.machines.append(StateMachine(drive, program, self.sm_pins(i)))
+            self.outputs[drive] = Trace()
+            channel = defines.get(self.PREFIX + str(i + 1) + '_CHANNEL')
+            if channel != None:
+                self.channels[channel] = i
+        if 'IDLE_TIMEOUT_MS' in defines:
+            self.idle_timeout = defines['IDLE_TIMEOUT_MS'] * 1000
+        self.note = [0] * 16
+        self.pitchwheel = [8192] * 16
+        self.expected = {} # (drive, fifo value) -> frequency in Hz
+
+    def sm_pins(self, i):
+        return ['STEP', 'DIR']
+
+    def set_frequency(self, channel, time):
+        if channel not in self.channels:
+            return time
+        i = self.channels[channel]
+        note = self.note[channel] + pitch_to_note(self.pitchwheel[channel])
+        freq = note_to_hz(note)
+        if freq <= 0:
+            self.warn('note ' + str(note) + ' rounds to 0 Hz (division by zero)')
+            return time
+        value = 1000000 // freq // 2
+        self.expected[(i, value)] = 440.0 * math.pow(2.0, (note - 69.0) / 12.0)
+        return self.put_blocking(self.machines[i], value, time)
+
+    def set_enabled(self, channel, value, time):
+        if channel in self.channels:
+            self.gpio_put(self.machines[self.channels[channel]].name, value, time)
+
+    def run_command(self, channel, command, data1, data2, time):
+        if command == 0 or (command == 1 and data2 == 0): # Note Off
+            if data1 == self.note[channel]:
+                self.set_enabled(channel, 0, time)
+        elif command == 1: # Note On
+            self.note[channel] = data1
+            time = self.set_frequency(channel, time)
+            self.set_enabled(channel, 1, time)
+        elif command == 3: # Control Change
+            if data1 == 120 or data1 == 123:
+                self.set_enabled(channel, 0, time)
+        elif command == 6: # Pitch Bend
+            self.pitchwheel[channel] = (data2 << 7) | data1
+            time = self.set_frequency(channel, time)
+        return time
+
+
+class ScannerBoard(FloppyBoard):
+    # Keep in sync with init_pio() and init_sio() of pico/scanner/scanner.c
+    PINS = [2, 4, 6, 8]
+    ENABLE_PINS = [10, 11, 12, 13]
+    PREFIX = 'SCANNER'
+    DRIVES = 4
+
+    def sm_pins(self, i):
+        return ['STEP']
+
+
+class HddBoard(Board):
+    # Keep in sync with init_pio() and hdd_click() of pico/hdd/hdd.c
+    PINS = [2, 4, 6, 8, 10, 12, 14, 16]
+    CLICK_MACHINES = [0, 1, 2, 3, 8, 9, 10, 11] # Index 8 and up is pio1 state machine 4 and up
+
+    def __init__(self, name, board_id, program, defines):
+        Board.__init__(self, name, board_id)
+        for i in range(8):
+            self.machines.append(StateMachine('hdd' + str(i + 1), program, ['A', 'B']))
+        self.click_time = defines['HDD_CLICK_TIME']
+        self.channel = defines.get('HDD_CHANNEL', 9)
+        self.notes = {}
+        for i in range(8):
+            note = defines.get('HDD' + str(i + 1) + '_NOTE')
+            if note != None:
+                self.notes[note] = self.CLICK_MACHINES[i]
+        # init_pio() puts the click time in each OSR before enabling
+        for sm in self.machines:
+            sm.put(self.click_time, 0)
+
+    def run_command(self, channel, command, data1, data2, time):
+        if command == 1 and channel == self.channel and data2 > 0 and data1 in self.notes:
+            index = self.notes[data1]
+            sm = self.machines[index] if index < len(self.machines) else None
+            if sm == None:
+                self.warn('note ' + str(data1) + ' clicks pio1 state machine ' + str(index - 4) + ', which does not exist')
+                return time
+            time = self.put_blocking(sm, self.click_time, time)
+        return time
+
+
+def midi_bytes(midi_file):
+    # The byte stream player.py sends: (time in us, bytes) per message
+    events = []
+    for track in midi_file.tracks:
+        tick = 0
+        bank = 0
+        for msg in track:
+            tick += msg.time
+            if msg.type == 'midi_port':
+                bank = msg.port & 0x7F
+            elif msg.type == 'set_tempo' or not msg.is_meta:
+                events.append((tick, bank, msg))
+    events.sort(key = lambda event: event[0])
+
+    tempo = 500000
+    last_tick = 0
+    seconds = 0.0
+    current_bank = 0
+    yield 0.0, bytes([PORT_SELECT, 0, 0]) # reset_bank() when the port opens
+    for tick, bank, msg in events:
+        seconds += mido.tick2second(tick - last_tick, midi_file.ticks_per_beat, tempo)
+        last_tick = tick
+        if msg.type == 'set_tempo':
+            tempo = msg.tempo
+            continue
+        data = bytes(msg.bytes())
+        if hasattr(msg, 'channel') and bank != current_bank:
+            data = bytes([PORT_SELECT, bank]) + data
+            current_bank = bank
+        yield seconds * 1e6, data
+
+
+def uart_stream(messages):
+    # Arrival time of every byte on the 31250 baud line
+    line_free = 0.0
+    for time, data in messages:
+        for byte in data:
+            line_free = max(line_free, time) + BYTE_TIME
+            yield line_free, byte
+
+
+def simulate(board, stream):
+    # The main() loop of the firmwares: uart_getc() returns at the byte's
+    # arrival time, or right away if the CPU is behind
+    arrivals = []
+    data = []
+    for arrival, byte in stream:
+        arrivals.append(arrival)
+        data.append(byte)
+
+    cpu = 0.0
+    index = 0
+    overruns = 0
+
+    def getc():
+        nonlocal cpu, index, overruns
+        if index >= len(data):
+            raise EOFError
+        cpu = max(cpu, arrivals[index])
+        # Bytes that arrived but weren't read yet
+        if bisect.bisect_right(arrivals, cpu) - index > UART_FIFO_DEPTH:
+            overruns += 1
+        byte = data[index]
+        index += 1
+        return byte
+
+    try:
+        while True:
+            status = getc()
+            if status == SYSEX_START:
+                # Only used for the board config, skip to its end byte
+                while getc() != SYSEX_END:
+                    pass
+                continue
+            if status == PORT_SELECT:
+                data1 = getc()
+                if data1 < 0x80:
+                    board.selected_bank = data1
+                continue
+            if status < 0x80:
+                continue
+            command = (status >> 4) & 7
+            channel = status & 15
+            data1 = getc()
+            if data1 >= 0x80:
+                continue
+            data2 = 0
+            if command != 4 and command != 5:
+                data2 = getc()
+                if data2 >= 0x80:
+                    continue
+            if board.selected_bank != board.board_id:
+                continue
+            board.keep_awake(cpu)
+            board.run_until(cpu)
+            cpu = board.run_command(channel, command, data1, data2, cpu)
+    except EOFError:
+        pass
+    return cpu, overruns
+
+
+def vcd_id(number):
+    # Short printable identifier for a VCD signal
+    chars = ''
+    number += 1
+    while number > 0:
+        number, rest = divmod(number - 1, 94)
+        chars += chr(33 + rest)
+    return chars
+
+
+def write_vcd(path, boards, selected, start, end):
+    signals = []
+    for board in boards:
+        for i, sm in enumerate(board.machines):
+            if sm == None or sm.name not in selected:
+                continue
+            for bit, pin in enumerate(sm.pins):
+                signals.append((board.name, sm.name + '_' + pin, sm.trace, bit))
+            if sm.name in board.outputs:
+                signals.append((board.name, sm.name + '_EN', board.outputs[sm.name], 0))
+
+    changes = []
+    for number, (scope, name, trace, bit) in enumerate(signals):
+        last = (trace.value_at(start) >> bit) & 1
+        changes.append((int(start), vcd_id(number), last))
+        for time, value in trace.edges(start, end):
+            value = (value >> bit) & 1
+            if value != last:
+                changes.append((int(time), vcd_id(number), value))
+                last = value
+    changes.sort(key = lambda change: change[0])
+
+    with open(path, 'w') as file:
+        file.write('$timescale 1us $end\n')
+        scope = None
+        for number, (board_name, name, trace, bit) in enumerate(signals):
+            if board_name != scope:
+                if scope != None:
+                    file.write('$upscope $end\n')
+                file.write('$scope module ' + board_name + ' $end\n')
+                scope = board_name
+            file.write('$var wire 1 ' + vcd_id(number) + ' ' + name + ' $end\n')
+        if scope != None:
+            file.write('$upscope $end\n')
+        file.write('$enddefinitions $end\n')
+        last_time = None
+        for time, ident, value in changes:
+            if time != last_time:
+                file.write('#' + str(time) + '\n')
+                last_time = time
+            file.write(str(value) + ident + '\n')
+
+
+def enabled_windows(trace, end):
+    # Time ranges in which an enable output is high
+    windows = []
+    since = None
+    for time, value in trace.edges():
+        if value and since == None:
+            since = time
+        elif not value and since != None:
+            windows.append((since, time))
+            since = None
+    if since != None:
+        windows.append((since, end))
+    return windows
+
+
+def render_wav(path, boards, end, rate):
+    # Every step (or coil pulse) is a short click
+    length = int(end / 1e6 * rate) + rate // 10
+    samples = array.array('f', [0.0] * length)
+    click = [math.exp(-i / 6.0) * math.cos(2 * math.pi * 1500 * i / rate) for i in range(48)]
+
+    def add(time):
+        start = int(time / 1e6 * rate)
+        for i, sample in enumerate(click[:length - start]):
+            samples[start + i] += sample
+
+    for board in boards:
+        for sm in board.machines:
+            if sm == None:
+                continue
+            if sm.name in board.outputs:
+                windows = enabled_windows(board.outputs[sm.name], end)
+            else:
+                windows = [(0, end)]
+            for window_start, window_end in windows:
+                last = sm.trace.value_at(window_start)
+                for time, value in sm.trace.edges(window_start, window_end):
+                    if sm.pins[0] == 'STEP':
+                        if value & 1 and not last & 1:
+                            add(time)
+                    elif value and not last:
+                        add(time)
+                    last = value
+
+    peak = max(1e-9, max(samples), -min(samples))
+    pcm = array.array('h', (int(sample / peak * 32000) for sample in samples))
+    with wave.open(path, 'wb') as file:
+        file.setnchannels(1)
+        file.setsampwidth(2)
+        file.setframerate(rate)
+        file.writeframes(pcm.tobytes())
+
+
+def check_pulses(board, sm, end, min_pulse, min_setup):
+    # Find too short STEP pulses and DIR changes right before a step
+    glitches = []
+    if sm.pins[0] != 'STEP':
+        return glitches
+    windows = enabled_windows(board.outputs[sm.name], end)
+    if not windows:
+        return glitches
+    for window_start, window_end in windows:
+        last_step = None
+        last_dir = None
+        step_since = None
+        dir_since = None
+        for time, value in sm.trace.edges(window_start, window_end, max_repeats = 2):
+            step = value & 1
+            direction = (value >> 1) & 1
+            if step != last_step:
+                if step_since != None and time - step_since < min_pulse:
+                    glitches.append((time, sm.name + ' STEP ' + ('low' if step else 'high') +
+                                     ' for only ' + str(time - step_since) + ' us'))
+                if step and dir_since != None and len(sm.pins) > 1 and time - dir_since < min_setup:
+                    glitches.append((time, sm.name + ' DIR changed only ' + str(time - dir_since) +
+                                     ' us before STEP'))
+                step_since = time
+                last_step = step
+            if direction != last_dir:
+                if last_dir != None:
+                    dir_since = time
+                last_dir = direction
+    return glitches
+
+
+def step_rate(sm, start, end, max_steps = 64):
+    # Steps per second from the rising STEP edges between start and end.
+    # Only an even number of intervals is used, because the two halves of
+    # a note period (DIR low and high) don't take exactly the same time.
+    rising = []
+    last = sm.trace.value_at(start) & 1
+    for time, value in sm.trace.edges(start, end):
+        if value & 1 and not last:
+            rising.append(time)
+            if len(rising) > max_steps:
+                break
+        last = value & 1
+    intervals = (len(rising) - 1) // 2 * 2
+    if intervals == 0:
+        return None
+    return intervals * 1e6 / (rising[intervals] - rising[0])
+
+
+def report(boards, end, overruns, args):
+    # Print the timing report and return the number of problems
+    problems = 0
+    print('Simulated %.1f s of music' % (end / 1e6))
+
+    print('\nPitch accuracy (step rate vs. note frequency, whole octaves removed):')
+    worst = []
+    unmeasured = 0
+    for board in boards:
+        if not isinstance(board, FloppyBoard):
+            continue
+        for (i, value), expected in sorted(board.expected.items()):
+            sm = board.machines[i]
+            # Measure the STEP pulses in the trace while this value was loaded
+            loads = sm.loads + [(end, None)]
+            measured = None
+            for k in range(len(loads) - 1):
+                if loads[k][1] == value:
+                    measured = step_rate(sm, loads[k][0], loads[k + 1][0])
+                    if measured != None:
+                        break
+            if measured == None:
+                unmeasured += 1
+                continue
+            cents = 1200 * math.log2(measured / expected)
+            octaves = round(cents / 1200)
+            worst.append((abs(cents - octaves * 1200), sm.name, expected, measured, cents - octaves * 1200, octaves))
+    worst.sort(reverse = True)
+    for error, name, expected, measured, cents, octaves in worst[:args.top]:
+        print('  %-9s %8.2f Hz -> %8.2f Hz  %+7.1f cents  (%+d octaves)' % (name, expected, measured, cents, octaves))
+    if worst:
+        print('  Worst: %.1f cents over %d notes' % (worst[0][0], len(worst)))
+        if worst[0][0] > args.max_cents:
+            problems += 1
+    if unmeasured:
+        # Notes that never played three STEP pulses, like short notes under pitch bend
+        print('  %d notes were too short to measure' % unmeasured)
+        if not worst:
+            problems += 1
+
+    print('\nRetune latency (CPU write to PIO pull):')
+    for board in boards:
+        latencies = [(pulled - written, written, sm.name)
+                     for sm in board.machines if sm != None for written, pulled in sm.latencies if written > 0]
+        if latencies:
+            latencies.sort(reverse = True)
+            average = sum(latency for latency, written, name in latencies) / len(latencies)
+            print('  %-8s %6d writes, %8.1f us average, %8.1f us max (%s at %.3f s)' % (
+                board.name, len(latencies), average, latencies[0][0], latencies[0][2], latencies[0][1] / 1e6))
+        stalled = sum(duration for start, duration in board.stalls)
+        if board.stalls:
+            longest = max(board.stalls, key = lambda stall: stall[1])
+            print('  %-8s main loop blocked on a full FIFO %d times, %.1f us in total, %.1f us max at %.3f s' % (
+                board.name, len(board.stalls), stalled, longest[1], longest[0] / 1e6))
+        for text, count in board.warnings.items():
+            print('  %-8s WARNING: %s (%d times)' % (board.name, text, count))
+            problems += 1
+    if overruns:
+        print('  %d bytes were read after the UART receive FIFO was full (they would be lost)' % overruns)
+        problems += 1
+
+    print('\nGlitches (STEP pulses under %d us, DIR changes under %d us before STEP):' % (args.min_pulse, args.min_setup))
+    glitches = []
+    for board in boards:
+        for sm in board.machines:
+            if sm != None and sm.name in board.outputs:
+                glitches += check_pulses(board, sm, end, args.min_pulse, args.min_setup)
+    glitches.sort()
+    for time, text in glitches[:args.top]:
+        print('  %.6f s: %s' % (time / 1e6, text))
+    print('  %d found' % len(glitches))
+    problems += len(glitches)
+    return problems
+
+
+def main():
+    parser = argparse.ArgumentParser(description = 'Simulate the FloppIO PIO programs on a midi file')
+    parser.add_argument('file', help = 'the midi file to replay')
+    parser.add_argument('--board', type = int, default = 0, help = 'board ID of the simulated picos (default: 0)')
+    parser.add_argument('--vcd', metavar = 'FILE', help = 'write pin traces to a VCD file')
+    parser.add_argument('--wav', metavar = 'FILE', help = 'write a rough audio render to a WAV file')
+    parser.add_argument('--rate', type = int, default = 22050, help = 'sample rate of the WAV file')
+    parser.add_argument('--trace', metavar = 'DRIVES',
+                        help = 'comma separated drives in the VCD file, e.g. fdd1,hdd3 (default: all that play)')
+    parser.add_argument('--start', type = float, default = 0, help = 'start of the VCD file in seconds')
+    parser.add_argument('--end', type = float, default = math.inf, help = 'end of the VCD file in seconds')
+    parser.add_argument('--min-pulse', type = int, default = 3, help = 'shortest allowed STEP high or low time in us')
+    parser.add_argument('--min-setup', type = int, default = 10, help = 'shortest allowed time between DIR and STEP in us')
+    parser.add_argument('--max-cents', type = float, default = 50, help = 'largest allowed pitch error in cents')
+    parser.add_argument('--top', type = int, default = 10, help = 'number of entries listed per section')
+    parser.add_argument('--strict', action = 'store_true', help = 'exit with code 1 if any problem is found')
+    args = parser.parse_args()
+
+    boards = [
+        FloppyBoard('floppy', args.board, parse_pio(os.path.join(PICO_DIR, 'floppy', 'program.pio'))['fdd'],
+                    read_defines(os.path.join(PICO_DIR, 'floppy', 'floppy.c'))),
+        ScannerBoard('scanner', args.board, parse_pio(os.path.join(PICO_DIR, 'scanner', 'program.pio'))['scanner'],
+                     read_defines(os.path.join(PICO_DIR, 'scanner', 'scanner.c'))),
+        HddBoard('hdd', args.board, parse_pio(os.path.join(PICO_DIR, 'hdd', 'program.pio'))['hdd'],
+                 read_defines(os.path.join(PICO_DIR, 'hdd', 'hdd.c'))),
+    ]
+
+    midi_file = mido.MidiFile(args.file)
+    stream = list(uart_stream(midi_bytes(midi_file)))
+    end = 0
+    overruns = 0
+    for board in boards:
+        cpu, board_overruns = simulate(board, stream)
+        end = max(end, cpu)
+        overruns += board_overruns
+    end += 100000 # Let the last notes ring for a bit
+    for board in boards:
+        board.run_until(end)
+
+    if args.vcd:
+        if args.trace:
+            selected = set(args.trace.split(','))
+        else:
+            selected = set(sm.name for board in boards for sm in board.machines
+                           if sm != None and (sm.name not in board.outputs or len(board.outputs[sm.name].items) > 1)
+                           and any(written > 0 for written, pulled in sm.latencies))
+        write_vcd(args.vcd, boards, selected, args.start * 1e6, min(end, args.end * 1e6))
+    if args.wav:
+        render_wav(args.wav, boards, end, args.rate)
+
+    problems = report(boards, end, overruns, args)
+    if args.strict and problems:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except PioError as error:
+        print('[ERROR] ' + str(error), flush = True)
+        sys.exit(2)